@@ -1,5 +1,6 @@
 #include "AVLTree.h"
 
+#include <algorithm>
 #include <iostream>
 #include <ostream>
 #include <string>
@@ -7,114 +8,439 @@
 using KeyType = string;
 using ValueType = size_t;
 
+// how many tombstones each lazy remove unlinks while a compaction pass is running
+const size_t compactionStep = 4;
+
 ///Constructor for AVLNode
 /*
 This creates a node with the chosen key and value, with left and right set to null
 It also allows for the values of AVLNode to be assigned on creation
 */
-AVLTree::AVLNode::AVLNode(const KeyType key, const size_t value) : left(nullptr), right(nullptr)
+AVLTree::AVLNode::AVLNode(const KeyType key, const size_t value) : height(0), left(nullptr), right(nullptr),
+                                                                    parent(nullptr), subtree(nullptr),
+                                                                    referenced(false), aggregateStale(false),
+                                                                    tombstone(false),
+                                                                    tombstonesBelow(0)
 {
     this->key = key;
     this->value = value;
 }
 
+///Destructor for AVLNode
+/*
+Frees the node's aggregate, its children are freed separately by whoever owns the tree
+*/
+AVLTree::AVLNode::~AVLNode()
+{
+    delete subtree;
+}
+
 ///Constructor for AVLTree
 /*
 This creates the AVL Tree which is a binary search tree that automatically balances itslef
 This initializes the two values stored in the tree to null
 */
-AVLTree::AVLTree() : treeSize(0), root(nullptr)
+AVLTree::AVLTree() : AVLTree(0, CacheBudget::None)
+{
+}
+
+///Constructor for a bounded AVLTree
+/*
+This creates an AVL Tree that works as an ordered cache. capacity is either a number of entries or a
+number of bytes (each node plus its key's characters), depending on budget. Whenever an insert
+pushes the tree over capacity, nodes are evicted with the CLOCK algorithm: reads through get() and
+operator[] set a bit on the node, and the eviction sweep walks the keys in order, clearing set bits
+and removing the first node it finds without one.
+*/
+AVLTree::AVLTree(size_t capacity, CacheBudget budget) : treeSize(0), root(nullptr), budget(budget),
+                                                        capacity(capacity), usedBytes(0), clockHand(nullptr),
+                                                        cacheHits(0), cacheMisses(0), cacheEvictions(0),
+                                                        aggregates(false), lazyRemove(false), compactThreshold(0),
+                                                        tombstones(0), compacting(false)
 {
 }
 
 ///insert - inserts a key/value pair into the tree, automatically rebalancing if necessary
 /*
-This is the public version of the insert method, which calls the private recursive one.
-After adding the value to the tree, it runs the balance method to update the heights
-and rebalance the tree
+This is the public version of the insert method. It is a hinted insert that starts at the root,
+so the node is placed with a single descent and the tree is rebalanced on the way back up
 
 Returns: True if a value was inserted, False if the value already exists
 */
 bool AVLTree::insert(const KeyType& key, ValueType value)
 {
-    bool status = insert(key, value, root);
-    balance(key, root);
-    return status;
+    Cursor hint;
+    return insert(hint, key, value);
 }
 
-///insert (helper) - private recursive helper function for the public insert function
+///insert (hinted) - inserts a key/value pair starting the search from a previous position
 /*
-This function recursively iterates through the tree until it reaches a null pointer,
+Instead of descending from the root, the search climbs up from the hint only as far as needed
+to reach a subtree that can hold the key, then descends from there. For nearly sorted input
+where the hint is the previously inserted key this is close to constant time per key.
+After attaching the new leaf the heights are fixed bottom up, stopping as soon as a subtree
+height stops changing.
+
+An invalid (default) hint, or one from another tree, searches from the root. On return the hint
+points at the node holding the key, whether it was just inserted or was already there.
+In a bounded tree the insert can evict any other node, so every other cursor into the tree must be
+treated as invalid afterward. Only the hint passed in (now at the key) is safe to keep using.
 
-returns: true down the chain if node was successfully inserted, or false if the node already exists
+Returns: True if a value was inserted, False if the value already exists
 */
-bool AVLTree::insert(const KeyType& key, ValueType value, AVLNode*& current)
+bool AVLTree::insert(Cursor& hint, const KeyType& key, ValueType value)
 {
-    if (current == nullptr) //add node
+    if (root == nullptr)
     {
-        current = new AVLNode(key, value);
+        root = createNode(key, value);
         treeSize++;
-        current->height = 0;
+        usedBytes += nodeBytes(root);
+        hint = Cursor(this, root);
+        evict(root);
         return true;
     }
-    if (key < current->key)
+
+    // the cursor only hands out read access, but hintNode checked that the node belongs to this tree
+    const AVLNode* start = hintNode(hint);
+    AVLNode* current = const_cast<AVLNode*>(start ? fingerStart(start, key) : root);
+    while (true)
     {
-        bool resize = insert(key, value, current->left);
-        current->height = current->nodeHeight();
-        return resize;
+        if (key < current->key)
+        {
+            if (current->left == nullptr)
+            {
+                current->left = createNode(key, value);
+                current->left->parent = current;
+                current = current->left;
+                break;
+            }
+            current = current->left;
+        }
+        else if (key > current->key)
+        {
+            if (current->right == nullptr)
+            {
+                current->right = createNode(key, value);
+                current->right->parent = current;
+                current = current->right;
+                break;
+            }
+            current = current->right;
+        }
+        else
+        {
+            hint = Cursor(this, current);
+            if (!current->tombstone) return false;
+            // the key was removed lazily, so the node comes back with the new value
+            current->tombstone = false;
+            current->value = value;
+            tombstones--;
+            for (AVLNode* node = current; node; node = node->parent) node->tombstonesBelow--;
+            if (aggregates) refreshPath(current);
+            evict(current);
+            return true;
+        }
     }
-    if (key > current->key)
+    treeSize++;
+    usedBytes += nodeBytes(current);
+    hint = Cursor(this, current);
+    if (aggregates) refreshPath(current->parent);
+    rebalanceUpward(current->parent);
+    evict(current);
+    return true;
+}
+
+///hintNode (helper) - the node a hint points at, if the hint can be used on this tree
+/*
+Copies of a tree have their own nodes, so a cursor from anywhere else (including a copy of this
+tree) would send the search into nodes this tree doesn't own. Those are treated like an invalid hint.
+
+returns the hint's node, or nullptr if the hint is invalid or belongs to another tree
+*/
+const AVLTree::AVLNode* AVLTree::hintNode(const Cursor& hint) const
+{
+    if (hint.tree != this) return nullptr;
+    return hint.node;
+}
+
+///fingerStart (helper) - finds where a search for key should begin when starting from a hint
+/*
+Every node covers a range of keys bounded by the closest ancestors it hangs left and right of.
+This function climbs from the hint until it reaches the lowest node whose range contains the key,
+which only needs to look at the bound on the side the key lies on. Climbing through nodes that
+don't tighten that bound doesn't move the starting point, so the descent afterward doesn't
+repeat them.
+
+returns the node to descend from, which is the root when the key is outside the hint's neighborhood
+*/
+const AVLTree::AVLNode* AVLTree::fingerStart(const AVLNode* hint, const KeyType& key) const
+{
+    const AVLNode* start = hint;
+    const AVLNode* current = hint;
+    if (key == hint->key) return hint;
+    bool goingRight = key > hint->key;
+    while (current->parent)
     {
-        bool resize = insert(key, value, current->right);
-        current->height = current->nodeHeight();
-        return resize;
+        const AVLNode* parent = current->parent;
+        if (goingRight && current == parent->left)
+        {
+            // parent is the upper bound of current's range
+            if (key < parent->key) return start;
+            start = parent;
+            if (key == parent->key) return start;
+        }
+        else if (!goingRight && current == parent->right)
+        {
+            // parent is the lower bound of current's range
+            if (key > parent->key) return start;
+            start = parent;
+            if (key == parent->key) return start;
+        }
+        current = parent;
     }
-    return false;
+    return start;
 }
 
 ///remove - removes a key/value pair from the tree, automatically rebalancing if necessary
 /*
-This is the public version of the remove method, which calls the private recursive one.
-After removing the value to the tree, it runs the balance method to update the heights
-and rebalance the tree
+This finds the node for the key and hands it to removeNode, which unlinks it and rebalances
+from the spot it was taken out of back up toward the root.
+With lazy remove enabled the node is only marked as a tombstone, and while a compaction pass is
+running the remove also unlinks a few of the oldest tombstones (see enableLazyRemove).
 
 Returns: True if a value was removed, False if the value doesn't exist
 */
 bool AVLTree::remove(const KeyType& key)
 {
-    bool status = remove(key, root);
-    balance(key, root);
-    return status;
+    AVLNode* node = getNode(key, root);
+    if (node == nullptr) return false;
+    if (lazyRemove)
+    {
+        markRemoved(node);
+        continueCompaction();
+        return true;
+    }
+    removeNode(node);
+    return true;
 }
 
-///remove (helper) - private recursive helper function for the public remove function
+///applyBatch - applies a batch of inserts, updates and removes
 /*
-This function recursively iterates through the tree until it reaches a matching key, calling removeNode
-once it has been found. It will stop and return false if it reaches a nullpointer
-which signifies that the key is not in the tree.
+The batch is put in key order (mutations on the same key keep the order they were given in) and
+walked down the tree in one pass: at each node the sorted keys split into the ones that belong on
+the left, the ones for the node itself and the ones on the right, and each side is merged into its
+subtree the same way. Subtrees no key falls into are never visited. On the way back up every
+touched node is joined back together with its two merged sides, so it is rebalanced once however
+many keys went below it, and a side that grew or shrank by a lot is hung off the other side's
+spine at the matching height instead of being rotated into place one level at a time.
+This shares the descent between keys that are close together, so it does the most good for
+batches that are large or clustered. A batch of scattered keys that is small next to the tree has
+little descent to share, and the sort and the splitting make it somewhat slower than calling
+insert, remove and update for each key (in the bench, up to about a thousand random keys into a
+tree of 200000, with the batch ahead from about five thousand).
+
+Insert only adds missing keys, Update only changes existing keys and Remove deletes keys, the same
+as insert, update and remove. A lazily removed key the batch touches is freed and counts as missing.
+Cursors are invalidated by a batch.
+
+returns whether each mutation took effect, in the same order as the batch
+*/
+vector<bool> AVLTree::applyBatch(span<const Mutation> batch)
+{
+    vector<bool> results(batch.size(), false);
+    vector<size_t> order(batch.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    auto byKey = [&batch](size_t a, size_t b) { return batch[a].key < batch[b].key; };
+    if (!is_sorted(order.begin(), order.end(), byKey))
+    {
+        stable_sort(order.begin(), order.end(), byKey);
+    }
+
+    optional<KeyType> handKey;
+    if (clockHand) handKey = clockHand->key;
+    bool reshaped = false;
+    root = mergeBatch(root, batch, order, 0, order.size(), results, reshaped);
+    if (root) root->parent = nullptr;
+    if (handKey && clockHand == nullptr)
+    {
+        // the batch removed the clock hand's node, so it moves on to the next key still in the tree
+        for (AVLNode* current = root; current;)
+        {
+            if (current->key < *handKey)
+            {
+                current = current->right;
+            }
+            else
+            {
+                clockHand = current;
+                current = current->left;
+            }
+        }
+    }
+    evict(nullptr);
+    return results;
+}
 
-returns: true if the node is found and successfully removed, or false if it reaches a null pointer
+///mergeBatch (helper) - apply order[low, high) of a sorted batch to the subtree at current
+/*
+current's old links are only read here, the subtree is put back together by join, so nodes can
+be freed or added anywhere below without patching their neighbours. An empty spot in the tree
+gets every key that lands on it at once, built into a balanced subtree.
+reshaped tells the caller whether the subtree's root or height changed. When neither side of a
+node was reshaped and the node itself wasn't replaced, its balance can't have changed either, so
+like rebalanceUpward stopping early it skips the join and only refreshes what it stores about
+its contents. This is tracked rather than worked out from pointers afterward, because a node the
+batch frees can come back from new at the same address.
+
+returns the new root of the subtree (its parent pointer is set by the caller), or nullptr if it is empty
 */
-bool AVLTree::remove(const KeyType& key, AVLNode*& current)
+AVLTree::AVLNode* AVLTree::mergeBatch(AVLNode* current, span<const Mutation> batch, const vector<size_t>& order,
+                                      size_t low, size_t high, vector<bool>& results, bool& reshaped)
 {
+    reshaped = false;
+    if (low == high) return current;
     if (current == nullptr)
     {
-        return false;
+        vector<AVLNode*> added;
+        AVLNode* node = nullptr;
+        for (size_t i = low; i < high;)
+        {
+            const KeyType& key = batch[order[i]].key;
+            node = nullptr;
+            for (; i < high && batch[order[i]].key == key; i++)
+            {
+                results[order[i]] = applyMutation(batch[order[i]], node);
+            }
+            // a single key is the usual case for scattered batches, and needs no building
+            if (i < high || !added.empty())
+            {
+                if (node) added.push_back(node);
+                node = nullptr;
+            }
+        }
+        if (node == nullptr) node = buildBalanced(added, 0, added.size(), nullptr);
+        else if (aggregates) refreshAggregate(node); // a later Update may have changed its value
+        reshaped = node != nullptr;
+        return node;
     }
-    if (key < current->key)
+
+    auto first = order.begin() + low;
+    auto last = order.begin() + high;
+    size_t middle = partition_point(first, last, [&](size_t i) { return batch[i].key < current->key; }) - order.begin();
+    size_t end = partition_point(order.begin() + middle, last,
+                                 [&](size_t i) { return batch[i].key == current->key; }) - order.begin();
+
+    bool leftReshaped = false;
+    bool rightReshaped = false;
+    AVLNode* left = mergeBatch(current->left, batch, order, low, middle, results, leftReshaped);
+    AVLNode* right = mergeBatch(current->right, batch, order, end, high, results, rightReshaped);
+    size_t oldHeight = current->height;
+    AVLNode* node = current;
+    bool replaced = false;
+    if (middle < end && node->tombstone)
     {
-        bool resize = remove(key, current->left);
-        if (resize) current->height = current->nodeHeight();
-        return resize;
+        // a lazily removed key is treated as missing, so its node goes now
+        tombstones--;
+        treeSize--;
+        discardNode(node);
+        node = nullptr;
+        replaced = true;
     }
-    if (key > current->key)
+    for (size_t i = middle; i < end; i++)
     {
-        bool resize = remove(key, current->right);
-        if (resize) current->height = current->nodeHeight();
-        return resize;
+        results[order[i]] = applyMutation(batch[order[i]], node);
+        if (results[order[i]] && batch[order[i]].type == MutationType::Remove) replaced = true;
     }
-    removeNode(current);
-    return true;
+
+    reshaped = true;
+    if (node == nullptr) return join(left, right);
+    if (!replaced && !leftReshaped && !rightReshaped)
+    {
+        if (aggregates) refreshAggregate(node);
+        if (lazyRemove) recountTombstones(node);
+        reshaped = false;
+        return node;
+    }
+    AVLNode* top = join(left, node, right);
+    // current is only compared against when it was never freed, so the addresses can be trusted here
+    reshaped = replaced || top != current || top->height != oldHeight;
+    return top;
+}
+
+///enableLazyRemove - make remove leave tombstones instead of restructuring the tree
+/*
+With this on, remove only finds the node and marks it, so a burst of removes does no rotations.
+Lookups, findRange, keys and the other queries skip marked nodes and size() doesn't count them.
+An insert of a marked key reuses its node.
+
+A lazy remove costs one lookup. That is no cheaper than an eager remove of random keys, and slower
+than eager removes in key order, where each unlink moves the successor up and shortens the next
+search. It pays off when removed keys are likely to be inserted again, or when the unlinking can be
+moved out of a latency sensitive burst into compact() calls made later.
+
+Once more than compactThreshold (a fraction from 0 to 1) of the nodes are tombstones, a compaction
+pass starts: every remove also unlinks up to compactionStep tombstones, so the pass drains them
+faster than removes add them, and it keeps going until they are down to half the threshold. No
+single remove does more than that bounded amount of restructuring. Calling compact(maxRemovals)
+when the tree is idle gets the same work done ahead of time, compact() does it all at once.
+*/
+void AVLTree::enableLazyRemove(double compactThreshold)
+{
+    lazyRemove = true;
+    this->compactThreshold = compactThreshold;
+}
+
+///compact - unlink up to maxRemovals tombstones
+/*
+Every node counts the tombstones in its subtree, so each step descends straight to the leftmost
+tombstone and removes it the same way as an eager remove. Live nodes are never walked over, so a
+call costs O(maxRemovals * log n) no matter how the tombstones are spread out, and a large burst of
+removes can be cleaned up a few nodes at a time.
+Cursors to removed keys are invalidated.
+
+returns how many tombstones were unlinked
+*/
+size_t AVLTree::compact(size_t maxRemovals)
+{
+    size_t removed = 0;
+    while (removed < maxRemovals && tombstones > 0)
+    {
+        AVLNode* node = firstTombstone();
+        tombstones--;
+        removeNode(node);
+        removed++;
+    }
+    return removed;
+}
+
+///compact - unlink every tombstone by rebuilding the tree
+/*
+This walks the whole tree once, frees the tombstones and links the rest back together balanced,
+which is cheaper than removing a large share of the nodes one at a time
+*/
+void AVLTree::compact()
+{
+    if (tombstones == 0) return;
+    vector<AVLNode*> nodes;
+    nodes.reserve(treeSize);
+    collectNodes(root, nodes);
+    vector<AVLNode*> live;
+    live.reserve(treeSize - tombstones);
+    for (AVLNode* node : nodes)
+    {
+        if (node->tombstone) discardNode(node);
+        else live.push_back(node);
+    }
+    treeSize = live.size();
+    tombstones = 0;
+    compacting = false;
+    root = buildBalanced(live, 0, live.size(), nullptr);
+}
+
+///tombstoneCount - return how many lazily removed nodes are still in the tree
+size_t AVLTree::tombstoneCount() const
+{
+    return tombstones;
 }
 
 ///getNode (helper) - returns the pointer to the corresponding key for the operator[] overload
@@ -132,6 +458,7 @@ AVLTree::AVLNode* AVLTree::getNode(const KeyType& key, AVLNode* current)
     }
     if (key < current->key) return getNode(key, current->left);
     if (key > current->key) return getNode(key, current->right);
+    if (current->tombstone) return nullptr;
     return current;
 }
 
@@ -150,6 +477,7 @@ const AVLTree::AVLNode* AVLTree::readNode(const KeyType& key, const AVLNode* cur
     }
     if (key < current->key) return readNode(key, current->left);
     if (key > current->key) return readNode(key, current->right);
+    if (current->tombstone) return nullptr;
     return current;
 }
 
@@ -175,22 +503,107 @@ returns: nullopt if key is not in the tree, or its value if it is
 optional<ValueType> AVLTree::get(const KeyType& key) const
 {
     const AVLNode* node = readNode(key, root);
-    if (node == nullptr) return nullopt;
+    if (node == nullptr)
+    {
+        if (budget != CacheBudget::None) cacheMisses++;
+        return nullopt;
+    }
+    if (budget != CacheBudget::None)
+    {
+        cacheHits++;
+        node->referenced = true;
+    }
     return node->value;
 }
 
+///find - returns a cursor to the node holding key
+/*
+This is the same lookup as get(), but the returned cursor can be handed back to find() or insert()
+as a hint for the next key
+
+returns a cursor to the key's node, or an invalid cursor if the key is not in the tree
+*/
+AVLTree::Cursor AVLTree::find(const KeyType& key) const
+{
+    return Cursor(this, readNode(key, root));
+}
+
+///find (hinted) - returns a cursor to the node holding key, searching from a previous position
+/*
+The search climbs from the hint only as far as needed before descending (see fingerStart),
+so looking up keys close to the hint costs about the log of their distance instead of the
+log of the tree size. An invalid hint, or one from another tree, searches from the root.
+
+returns a cursor to the key's node, or an invalid cursor if the key is not in the tree
+*/
+AVLTree::Cursor AVLTree::find(const Cursor& hint, const KeyType& key) const
+{
+    const AVLNode* start = hintNode(hint);
+    if (start == nullptr) return find(key);
+    return Cursor(this, readNode(key, fingerStart(start, key)));
+}
+
 ///operator[] overload - return a reference to a key's value
 /*
 overloads the [] operator so that the values of the tree can be accessed and modified directly
+The key has to be in the tree (and not lazily removed). Nothing is inserted for a missing key and
+using the result is undefined, though a bounded tree still counts the lookup as a miss first.
+With aggregates on, the tree can't tell a read from a write here, so each call flags the path above
+the node for the range queries to recompute. update() changes a value without that cost.
 
 returns the value in the tree corresponding to the key placed between the brackets
 */
 ValueType& AVLTree::operator[](const KeyType& key)
 {
+    // the previous call's write (if any) is in place by now, so its path can be recomputed
+    refreshStale();
     AVLNode* node = getNode(key, root);
+    if (budget != CacheBudget::None)
+    {
+        if (node == nullptr)
+        {
+            cacheMisses++;
+        }
+        else
+        {
+            cacheHits++;
+            node->referenced = true;
+        }
+    }
+    // the caller may write through the reference, so the aggregates above it are recomputed when next used
+    if (aggregates) markStale(node);
     return node->value;
 }
 
+///update - change the value of a key that is already in the tree
+/*
+This is the same as writing through operator[], but because the new value is known up front the
+aggregates on the path to the root are recomputed straight away and nothing is left stale.
+A bounded tree counts it as a hit or a miss the same way.
+
+returns true if the key was found and updated, false if it isn't in the tree
+*/
+bool AVLTree::update(const KeyType& key, ValueType value)
+{
+    AVLNode* node = getNode(key, root);
+    if (budget != CacheBudget::None)
+    {
+        if (node == nullptr)
+        {
+            cacheMisses++;
+        }
+        else
+        {
+            cacheHits++;
+            node->referenced = true;
+        }
+    }
+    if (node == nullptr) return false;
+    node->value = value;
+    if (aggregates) refreshPath(node);
+    return true;
+}
+
 ///findRange - return a vector of all values between two keys
 /*
 Find range is a method to quickly check the values within parts of the tree
@@ -216,10 +629,192 @@ void AVLTree::findRange(const KeyType& lowKey, const KeyType& highKey, const AVL
 {
     if (current == nullptr) return;
     if (lowKey < current->key) findRange(lowKey, highKey, current->left, valueVec);
-    if (lowKey <= current->key && current->key <= highKey) valueVec.push_back(current->value);
+    if (lowKey <= current->key && current->key <= highKey && !current->tombstone) valueVec.push_back(current->value);
     if (highKey > current->key) findRange(lowKey, highKey, current->right, valueVec);
 }
 
+///enableAggregates - start keeping per subtree sums, minimums and maximums
+/*
+Once enabled every node also stores the sum, min and max of the values in its subtree, which lets
+sumRange, minRange and maxRange answer in O(log n) instead of walking the whole range.
+Inserts, removes, update(), rotations and batches recompute them along the path they changed.
+Writes through operator[] can't be seen directly, so the path above that node is flagged instead,
+and the next write or operator[] call recomputes it. Until then the range queries work it out as they go
+without storing it, so they never write to the tree and are safe to run from several readers at
+once (as long as nothing is writing). Keeping them costs a little on every write, so it is off until
+asked for.
+
+The aggregates are allocated here, sizeof(Aggregate) (32 bytes) per node on top of the pointer
+every node has, and a byte budget counts them from then on, so a bounded tree may evict to make room.
+*/
+void AVLTree::enableAggregates()
+{
+    if (aggregates) return;
+    aggregates = true;
+    vector<AVLNode*> nodes;
+    nodes.reserve(treeSize);
+    collectNodes(root, nodes);
+    for (AVLNode* node : nodes)
+    {
+        node->subtree = new Aggregate{true, 0, 0, 0};
+        node->aggregateStale = true;
+        usedBytes += sizeof(Aggregate);
+    }
+    if (root) refreshAggregate(root);
+    evict(nullptr);
+}
+
+///sumRange - return the sum of all values with keys between lowKey and highKey
+/*
+Both keys are included, the same as findRange
+
+returns the sum, which is 0 for an empty range
+*/
+ValueType AVLTree::sumRange(const KeyType& lowKey, const KeyType& highKey) const
+{
+    return aggregateRange(lowKey, highKey, root, true, true).sum;
+}
+
+///minRange - return the smallest value with a key between lowKey and highKey
+/*
+returns nullopt if no keys are in the range
+*/
+optional<ValueType> AVLTree::minRange(const KeyType& lowKey, const KeyType& highKey) const
+{
+    Aggregate result = aggregateRange(lowKey, highKey, root, true, true);
+    if (result.empty) return nullopt;
+    return result.min;
+}
+
+///maxRange - return the largest value with a key between lowKey and highKey
+/*
+returns nullopt if no keys are in the range
+*/
+optional<ValueType> AVLTree::maxRange(const KeyType& lowKey, const KeyType& highKey) const
+{
+    Aggregate result = aggregateRange(lowKey, highKey, root, true, true);
+    if (result.empty) return nullopt;
+    return result.max;
+}
+
+///aggregateRange (helper) - recursively combine the values in a key range
+/*
+lowBounded and highBounded say whether this subtree can still hold keys outside the range on that
+side. Once the search splits around a node in the range, each side only has one bound left, so
+it follows a single path down and picks up the other children whole. A subtree with no bounds left
+is entirely in range and its stored aggregate is used directly (when aggregates are off it is walked
+instead, so the answer is still right but takes O(range)).
+
+returns the combined sum, min and max, or an empty aggregate if nothing is in range
+*/
+AVLTree::Aggregate AVLTree::aggregateRange(const KeyType& lowKey, const KeyType& highKey, const AVLNode* current,
+                                           bool lowBounded, bool highBounded) const
+{
+    if (current == nullptr) return Aggregate{true, 0, 0, 0};
+    if (aggregates && !lowBounded && !highBounded) return readAggregate(current);
+    if (lowBounded && current->key < lowKey)
+    {
+        return aggregateRange(lowKey, highKey, current->right, true, highBounded);
+    }
+    if (highBounded && current->key > highKey)
+    {
+        return aggregateRange(lowKey, highKey, current->left, lowBounded, true);
+    }
+
+    Aggregate result = aggregateRange(lowKey, highKey, current->left, lowBounded, false);
+    if (!current->tombstone) result = combine(result, Aggregate{false, current->value, current->value, current->value});
+    return combine(result, aggregateRange(lowKey, highKey, current->right, false, highBounded));
+}
+
+///combine (helper) - merge two aggregates into one
+AVLTree::Aggregate AVLTree::combine(const Aggregate& first, const Aggregate& second)
+{
+    if (first.empty) return second;
+    if (second.empty) return first;
+    return Aggregate{false, first.sum + second.sum, min(first.min, second.min), max(first.max, second.max)};
+}
+
+///findPrefix - return every key/value pair whose key starts with prefix
+/*
+All keys that share a prefix sit next to each other in key order, so this only walks the part of
+the tree that can hold them instead of making the caller invent an upper bound for findRange.
+Pairs come back in ascending key order.
+
+returns a vector of key/value pairs for every key beginning with prefix
+*/
+vector<pair<KeyType, ValueType>> AVLTree::findPrefix(const KeyType& prefix) const
+{
+    vector<pair<KeyType, ValueType>> entries;
+    size_t count = 0;
+    findPrefix(prefix, root, 0, 0, &entries, count);
+    return entries;
+}
+
+///countPrefix - count the keys that start with prefix
+/*
+This walks the same part of the tree as findPrefix, but doesn't copy out any keys or values
+
+returns the number of keys beginning with prefix
+*/
+size_t AVLTree::countPrefix(const KeyType& prefix) const
+{
+    size_t count = 0;
+    findPrefix(prefix, root, 0, 0, nullptr, count);
+    return count;
+}
+
+///findPrefix (helper) - recursively collect or count keys starting with prefix
+/*
+lowCommon and highCommon are how many leading characters the prefix shares with the nearest
+ancestor keys on either side of this subtree. Every key in the subtree sorts between those two,
+so it shares at least the smaller of the two counts with the prefix as well, and comparing can
+skip that many characters. Subtrees that sort completely before or after the prefix are never
+visited.
+
+entries may be null when only the count is wanted
+*/
+void AVLTree::findPrefix(const KeyType& prefix, const AVLNode* current, size_t lowCommon, size_t highCommon,
+                         vector<pair<KeyType, ValueType>>* entries, size_t& count) const
+{
+    if (current == nullptr) return;
+    size_t common = commonPrefix(current->key, prefix, min(lowCommon, highCommon));
+
+    if (common == prefix.size()) // current starts with prefix, matches can be on both sides
+    {
+        findPrefix(prefix, current->left, lowCommon, common, entries, count);
+        if (!current->tombstone)
+        {
+            if (entries) entries->emplace_back(current->key, current->value);
+            count++;
+        }
+        findPrefix(prefix, current->right, common, highCommon, entries, count);
+    }
+    else if (common == current->key.size() ||
+        static_cast<unsigned char>(current->key[common]) < static_cast<unsigned char>(prefix[common]))
+    {
+        // current sorts before every key with the prefix
+        findPrefix(prefix, current->right, common, highCommon, entries, count);
+    }
+    else
+    {
+        // current sorts after every key with the prefix
+        findPrefix(prefix, current->left, lowCommon, common, entries, count);
+    }
+}
+
+///commonPrefix (helper) - length of the shared start of key and prefix
+/*
+The first from characters are already known to match, so the comparison starts there
+
+returns how many leading characters key and prefix have in common
+*/
+size_t AVLTree::commonPrefix(const KeyType& key, const KeyType& prefix, size_t from)
+{
+    size_t limit = min(key.size(), prefix.size());
+    while (from < limit && key[from] == prefix[from]) from++;
+    return from;
+}
+
 ///keys - return a vector of all keys in tree
 /*
 The keys() method will return a std::vector with all of the keys currently in the tree. The length
@@ -242,7 +837,7 @@ void AVLTree::keys(AVLNode* current, vector<KeyType>& keyVec) const
 {
     if (current == nullptr) return;
     keys(current->left, keyVec);
-    keyVec.push_back(current->key);
+    if (!current->tombstone) keyVec.push_back(current->key);
     keys(current->right, keyVec);
 }
 
@@ -252,7 +847,27 @@ The size() method returns how many key-value pairs are in the tree
 */
 size_t AVLTree::size() const
 {
-    return treeSize; //make sure insert and delete increments this value properly
+    return treeSize - tombstones; //make sure insert and delete increments this value properly
+}
+
+///byteSize - return how many bytes the nodes and their keys take up
+/*
+This is the amount a byte budget is checked against. It includes each node's aggregate once
+enableAggregates() has been called.
+*/
+size_t AVLTree::byteSize() const
+{
+    return usedBytes;
+}
+
+///cacheStats - return the hit, miss and eviction counters
+/*
+Hits and misses are counted by get() and operator[], evictions by inserts that went over budget.
+The counters only move when the tree was made with a budget.
+*/
+AVLTree::CacheStats AVLTree::cacheStats() const
+{
+    return CacheStats{cacheHits, cacheMisses, cacheEvictions};
 }
 
 ///getHeight - return stored value for the height of AVL tree's root node
@@ -285,10 +900,15 @@ size_t AVLTree::AVLNode::nodeHeight() const
 /*
 perform a deep copy
 */
-AVLTree::AVLTree(const AVLTree& other)
+AVLTree::AVLTree(const AVLTree& other) : budget(other.budget), capacity(other.capacity), clockHand(nullptr),
+                                          cacheHits(other.cacheHits), cacheMisses(other.cacheMisses),
+                                          cacheEvictions(other.cacheEvictions), aggregates(other.aggregates),
+                                          lazyRemove(other.lazyRemove), compactThreshold(other.compactThreshold),
+                                          tombstones(other.tombstones), compacting(other.compacting)
 {
-    root = copyNode(other.root, root);
+    root = copyNode(other.root, root, nullptr);
     treeSize = other.treeSize;
+    usedBytes = other.usedBytes;
 }
 
 ///copyNode (helper) - recursively go through a tree and copy its contents over
@@ -298,13 +918,19 @@ it doesn't check if the clone was wiped before copying, so that should be done b
 
 returns a pointer to a node to expedite the process
 */
-AVLTree::AVLNode* AVLTree::copyNode(const AVLNode* current, AVLNode*& clone)
+AVLTree::AVLNode* AVLTree::copyNode(const AVLNode* current, AVLNode*& clone, AVLNode* parent)
 {
     if (current == nullptr) return nullptr;
     clone = new AVLNode(current->key, current->value);
-
-    clone->left = copyNode(current->left, clone->left);
-    clone->right = copyNode(current->right, clone->right);
+    if (current->subtree) clone->subtree = new Aggregate(*current->subtree);
+    clone->parent = parent;
+    clone->referenced = current->referenced;
+    clone->aggregateStale = current->aggregateStale;
+    clone->tombstone = current->tombstone;
+    clone->tombstonesBelow = current->tombstonesBelow;
+
+    clone->left = copyNode(current->left, clone->left, clone);
+    clone->right = copyNode(current->right, clone->right, clone);
     clone->height = current->height;
     return clone;
 }
@@ -319,8 +945,20 @@ returns void
 void AVLTree::operator=(const AVLTree& other)
 {
     clearNode(root);
-    root = copyNode(other.root, root);
+    root = copyNode(other.root, root, nullptr);
     treeSize = other.treeSize;
+    usedBytes = other.usedBytes;
+    budget = other.budget;
+    capacity = other.capacity;
+    clockHand = nullptr;
+    cacheHits = other.cacheHits;
+    cacheMisses = other.cacheMisses;
+    cacheEvictions = other.cacheEvictions;
+    aggregates = other.aggregates;
+    lazyRemove = other.lazyRemove;
+    compactThreshold = other.compactThreshold;
+    tombstones = other.tombstones;
+    compacting = other.compacting;
 }
 
 ///deconstructor - deallocate allocated memory
@@ -350,7 +988,8 @@ The overload of the << operator aims to let the AVLTree be output to the ostream
 Since I am used to working on trees through the use of vectors, I figured a neat way
 to show the form of a tree would be through nested brackets:
     [B:2 [A:1 [] []], [C:3 [] []]]
-I also included the heights of each node to help with testing
+I also included the heights of each node to help with testing,
+and lazily removed nodes have a ~ in front of their key
 */
 ostream& operator<<(ostream& os, const AVLTree& avlTree)
 {
@@ -379,6 +1018,7 @@ void AVLTree::ostreamFeed(AVLNode* current, string& output)
     //building a bunch of nested vectors to print out the tree:
     //[key:value (height) [leftchild], [rightchild]]
     output += "[";
+    if (current->tombstone) output += "~"; //lazily removed
     output += current->key;
     output += ":";
     output += to_string(current->value);
@@ -416,35 +1056,27 @@ bool AVLTree::AVLNode::isLeaf() const
 
 /// removeNode (helper) - removes a node given by address
 /*
-This function handles the complex removal logic for when a node is removed from the AVL Tree
+This function handles the complex removal logic for when a node is removed from the AVL Tree.
+A node with two children is replaced by its in order successor, which is relinked into its place
+rather than copied so that no other node changes. Heights are then fixed from the lowest
+spot that lost a node back up toward the root.
 
-it returns true or false whether or not it functioned properly
+returns a node that is still in the tree near the removed one (for use as a hint), or nullptr
+if the tree is now empty
 */
-bool AVLTree::removeNode(AVLNode*& current)
+AVLTree::AVLNode* AVLTree::removeNode(AVLNode* current)
 {
-    if (!current)
-    {
-        return false;
-    }
-
-    AVLNode* toDelete = current;
-    auto nChildren = current->numChildren();
-    if (current->isLeaf())
-    {
-        // case 1 we can delete the node
-        current = nullptr;
-    }
-    else if (current->numChildren() == 1)
+    AVLNode* rebalanceFrom = nullptr;
+    AVLNode* nearby = nullptr;
+    if (current == clockHand) clockHand = successor(current);
+    if (current->numChildren() < 2)
     {
-        // case 2 - replace current with its only child
-        if (current->right)
-        {
-            current = current->right;
-        }
-        else
-        {
-            current = current->left;
-        }
+        // case 1 and 2 - replace current with its only child, or nothing for a leaf
+        AVLNode* child = current->left ? current->left : current->right;
+        if (child) child->parent = current->parent;
+        link(current) = child;
+        rebalanceFrom = current->parent;
+        nearby = current->parent ? current->parent : child;
     }
     else
     {
@@ -452,137 +1084,553 @@ bool AVLTree::removeNode(AVLNode*& current)
         // get smallest key in right subtree by
         // getting right child and go left until left is null
         AVLNode* smallestInRight = current->right;
-        // I could check if smallestInRight is null,
-        // but it shouldn't be since the node has two children
         while (smallestInRight->left)
         {
             smallestInRight = smallestInRight->left;
         }
-        std::string newKey = smallestInRight->key;
-        size_t newValue = smallestInRight->value;
-        cout << newKey << endl;
-        remove(smallestInRight->key, root);
+        if (smallestInRight == current->right)
+        {
+            rebalanceFrom = smallestInRight;
+        }
+        else
+        {
+            // its right child takes its old spot, then it takes over current's right subtree
+            rebalanceFrom = smallestInRight->parent;
+            rebalanceFrom->left = smallestInRight->right;
+            if (smallestInRight->right) smallestInRight->right->parent = rebalanceFrom;
+            smallestInRight->right = current->right;
+            current->right->parent = smallestInRight;
+        }
+        smallestInRight->left = current->left;
+        current->left->parent = smallestInRight;
+        smallestInRight->parent = current->parent;
+        smallestInRight->height = current->height;
+        link(current) = smallestInRight;
+        nearby = smallestInRight;
+    }
+    usedBytes -= nodeBytes(current);
+    delete current;
+    treeSize--;
 
-        current->key = newKey;
-        current->value = newValue;
+    // in case 3 the path up from rebalanceFrom passes through smallestInRight's new spot as well
+    if (aggregates) refreshPath(rebalanceFrom);
+    if (lazyRemove) recountTombstonePath(rebalanceFrom);
+    rebalanceUpward(rebalanceFrom);
+    return nearby;
+}
 
-        current->height = current->nodeHeight();
-        //balanceNode(current);
+///rotateRight (helper) - do a right rotation on nodes
+/*
+This is a helper function for balance that exectutes a right rotation of the nodes
+*/
+void AVLTree::rotateRight(AVLNode*& current)
+{
+    //move nodes
+    AVLNode* hold = current->left->right;
+    current->left->right = current;
+    current->left->parent = current->parent;
+    current->parent = current->left;
+    current = current->left;
+    current->right->left = hold;
+    if (hold) hold->parent = current->right;
 
-        return true; // we already deleted the one we needed to so return
+    //update heights
+    current->right->height = current->right->nodeHeight();
+    current->height = current->nodeHeight();
+    recountTombstones(current->right);
+    recountTombstones(current);
+    if (aggregates)
+    {
+        refreshAggregate(current->right);
+        refreshAggregate(current);
     }
-    delete toDelete;
-    treeSize--;
+}
 
-    return true;
+///rotateLeft (helper) - do a left rotation on nodes
+/*
+This is a helper function for balance that exectutes a left rotation of the nodes
+*/
+void AVLTree::rotateLeft(AVLNode*& current)
+{
+    //move nodes
+    AVLNode* hold = current->right->left;
+    current->right->left = current;
+    current->right->parent = current->parent;
+    current->parent = current->right;
+    current = current->right;
+    current->left->right = hold;
+    if (hold) hold->parent = current->left;
+
+    //update heights
+    current->left->height = current->left->nodeHeight();
+    current->height = current->nodeHeight();
+    recountTombstones(current->left);
+    recountTombstones(current);
+    if (aggregates)
+    {
+        refreshAggregate(current->left);
+        refreshAggregate(current);
+    }
 }
 
-///balanceNode (helper) - get key and get balanced
+///rebalanceUpward (helper) - fix heights and balance from a node up toward the root
 /*
-This helper function merely grabs the key for use in the primary helper function
+This walks up the parent pointers from the given node, updating heights and rotating wherever
+a node is out of balance. Once a subtree ends up with the same height it had before, nothing
+above it can have changed, so the walk stops there.
 */
-void AVLTree::balanceNode(AVLNode* current)
+void AVLTree::rebalanceUpward(AVLNode* current)
 {
-    balance(current->key, root);
+    while (current)
+    {
+        size_t oldHeight = current->height;
+        AVLNode*& slot = link(current);
+        // slot now holds whichever node roots this subtree after any rotation
+        slot = rebalance(current);
+        if (slot->height == oldHeight) return;
+        current = slot->parent;
+    }
 }
 
-///balance (helper) - balances the tree up to the specified node, updating the node heights in the process
+///rebalance (helper) - fix one node's height and rotate it back into balance
 /*
-This function handles both updating the node heights as well as performing rotations to rebalance the tree
+The node's children have to be balanced already and differ in height by no more than two.
+A rotated root takes over the node's parent pointer, but nothing above is relinked here.
+
+returns whichever node roots the subtree after any rotation
 */
-void AVLTree::balance(const KeyType& key, AVLNode*& current)
+AVLTree::AVLNode* AVLTree::rebalance(AVLNode* current)
 {
-    //get heights of nodes to determine balance
-    long long leftHeight = -1;
-    long long rightHeight = -1;
+    AVLNode* slot = current;
+    current->height = current->nodeHeight();
+    long long balance = heightOf(current->left) - heightOf(current->right);
 
-    //traverse the tree and get left & right node heights
-    if (current->left)
+    if (balance >= 2) // hook is to the left
     {
-        if (key < current->key) balance(key, current->left);
-        leftHeight = current->left->height;
+        if (heightOf(current->left->left) < heightOf(current->left->right)) rotateLeft(current->left); //left-right
+        rotateRight(slot);
     }
-    if (current->right)
+    else if (balance <= -2) // hook is to the right
     {
-        if (key > current->key) balance(key, current->right);
-        rightHeight = current->right->height;
+        if (heightOf(current->right->left) > heightOf(current->right->right)) rotateRight(current->right); //right-left
+        rotateLeft(slot);
     }
+    return slot;
+}
+
+///heightOf (helper) - height of a subtree, counting an empty one as -1
+long long AVLTree::heightOf(const AVLNode* node)
+{
+    if (node == nullptr) return -1;
+    return node->height;
+}
+
+///link (helper) - get the pointer that holds a node
+/*
+Rotations work on the pointer that holds a node rather than the node itself, so this returns either
+the root pointer or the matching child pointer of the node's parent
+*/
+AVLTree::AVLNode*& AVLTree::link(AVLNode* node)
+{
+    if (node->parent == nullptr) return root;
+    if (node->parent->left == node) return node->parent->left;
+    return node->parent->right;
+}
+
+///Cursor constructors - an empty cursor, or one at a given node of a given tree
+/*
+A default constructed cursor is invalid and makes hinted calls start at the root
+*/
+AVLTree::Cursor::Cursor() : tree(nullptr), node(nullptr)
+{
+}
+
+AVLTree::Cursor::Cursor(const AVLTree* tree, const AVLNode* node) : tree(tree), node(node)
+{
+}
+
+///Cursor::valid - whether the cursor points at a node
+bool AVLTree::Cursor::valid() const
+{
+    return node != nullptr;
+}
+
+///Cursor::key - the key at the cursor, only call this on a valid cursor
+const KeyType& AVLTree::Cursor::key() const
+{
+    return node->key;
+}
+
+///Cursor::value - the value at the cursor, only call this on a valid cursor
+ValueType AVLTree::Cursor::value() const
+{
+    return node->value;
+}
+
+///applyMutation (helper) - apply one batch mutation to the node for its key
+/*
+node is the tree's node for the mutation's key, or nullptr if the key isn't in the tree.
+Inserting creates the node and removing deletes it, so node is updated to match.
+The node must already be out of the tree, mergeBatch links the result back in.
+
+returns whether the mutation took effect
+*/
+bool AVLTree::applyMutation(const Mutation& mutation, AVLNode*& node)
+{
+    switch (mutation.type)
+    {
+    case MutationType::Insert:
+        if (node) return false;
+        node = createNode(mutation.key, mutation.value);
+        usedBytes += nodeBytes(node);
+        treeSize++;
+        return true;
+    case MutationType::Update:
+        if (node == nullptr) return false;
+        node->value = mutation.value;
+        return true;
+    case MutationType::Remove:
+        if (node == nullptr) return false;
+        discardNode(node);
+        node = nullptr;
+        treeSize--;
+        return true;
+    }
+    return false;
+}
+
+///join (helper) - link two subtrees and a node between them into one balanced subtree
+/*
+Every key in left is smaller than middle's key and every key in right is larger, but the two
+heights can be anything. If they are within one of each other middle just becomes their parent.
+Otherwise the shorter side and middle go down the taller side's inner spine to the first subtree no
+more than one taller than it, and are joined there, which only unbalances the nodes on the way back
+up by at most two, so one rebalance each fixes them.
+
+returns the root of the joined subtree (its parent pointer is set by the caller)
+*/
+AVLTree::AVLNode* AVLTree::join(AVLNode* left, AVLNode* middle, AVLNode* right)
+{
+    AVLNode* top = middle;
+    if (heightOf(left) > heightOf(right) + 1)
+    {
+        top = left;
+        left->right = join(left->right, middle, right);
+        left->right->parent = left;
+    }
+    else if (heightOf(right) > heightOf(left) + 1)
+    {
+        top = right;
+        right->left = join(left, middle, right->left);
+        right->left->parent = right;
+    }
+    else
+    {
+        middle->left = left;
+        middle->right = right;
+        if (left) left->parent = middle;
+        if (right) right->parent = middle;
+    }
+    if (aggregates) refreshAggregate(top);
+    if (lazyRemove) recountTombstones(top);
+    return rebalance(top);
+}
+
+///join (helper) - link two subtrees with nothing between them
+/*
+The largest node of left is taken out and used as the middle node
+*/
+AVLTree::AVLNode* AVLTree::join(AVLNode* left, AVLNode* right)
+{
+    if (left == nullptr) return right;
+    if (right == nullptr) return left;
+    AVLNode* last = nullptr;
+    left = detachLast(left, last);
+    return join(left, last, right);
+}
+
+///detachLast (helper) - take the largest node out of a subtree
+/*
+last is set to the node that was taken out, and the nodes above it are rebalanced on the way back
+
+returns the subtree's new root (its parent pointer is set by the caller)
+*/
+AVLTree::AVLNode* AVLTree::detachLast(AVLNode* current, AVLNode*& last)
+{
+    if (current->right == nullptr)
+    {
+        last = current;
+        return current->left;
+    }
+    current->right = detachLast(current->right, last);
+    if (current->right) current->right->parent = current;
+    if (aggregates) refreshAggregate(current);
+    if (lazyRemove) recountTombstones(current);
+    return rebalance(current);
+}
+
+///collectNodes (helper) - populates a vector with every node in order
+/*
+this works the same as keys(), but keeps the nodes themselves so they can be relinked
+*/
+void AVLTree::collectNodes(AVLNode* current, vector<AVLNode*>& nodes)
+{
+    if (current == nullptr) return;
+    collectNodes(current->left, nodes);
+    nodes.push_back(current);
+    collectNodes(current->right, nodes);
+}
+
+///buildBalanced (helper) - link sorted nodes into a perfectly balanced subtree
+/*
+The middle node of [low, high) becomes the subtree's root and each half is built the same way
+underneath it, so sibling heights never differ by more than one
+
+returns the root of the built subtree, or nullptr for an empty range
+*/
+AVLTree::AVLNode* AVLTree::buildBalanced(const vector<AVLNode*>& nodes, size_t low, size_t high, AVLNode* parent)
+{
+    if (low >= high) return nullptr;
+    size_t middle = low + (high - low) / 2;
+    AVLNode* current = nodes[middle];
+    current->parent = parent;
+    current->left = buildBalanced(nodes, low, middle, current);
+    current->right = buildBalanced(nodes, middle + 1, high, current);
     current->height = current->nodeHeight();
+    if (aggregates) refreshAggregate(current);
+    recountTombstones(current);
+    return current;
+}
+
+///successor (helper) - next node in key order
+/*
+Using the parent pointers, this is the leftmost node of the right subtree if there is one,
+otherwise the first ancestor that the node is in the left subtree of
+
+returns the next node, or nullptr for the last node
+*/
+AVLTree::AVLNode* AVLTree::successor(AVLNode* node)
+{
+    if (node->right)
+    {
+        node = node->right;
+        while (node->left) node = node->left;
+        return node;
+    }
+    while (node->parent && node == node->parent->right) node = node->parent;
+    return node->parent;
+}
+
+///createNode (helper) - allocate an unlinked node for a key
+/*
+When aggregates are on the node gets one straight away, so nodeBytes counts it from the start
 
-    // bar unneccisarry calculations
-    if (current->height < 2) return;
+returns the new node
+*/
+AVLTree::AVLNode* AVLTree::createNode(const KeyType& key, ValueType value) const
+{
+    AVLNode* node = new AVLNode(key, value);
+    if (aggregates) node->subtree = new Aggregate{false, value, value, value};
+    return node;
+}
 
-    //check if tree needs rebalancing
-    long long balance = leftHeight - rightHeight;
+///nodeBytes (helper) - memory counted against a byte budget for one node
+size_t AVLTree::nodeBytes(const AVLNode* node)
+{
+    size_t bytes = sizeof(AVLNode) + node->key.size();
+    if (node->subtree) bytes += sizeof(Aggregate);
+    return bytes;
+}
 
-    if (balance >= 2) // hook is to the left
+///overBudget (helper) - whether a bounded tree holds more than its capacity
+bool AVLTree::overBudget() const
+{
+    if (budget == CacheBudget::Entries) return size() > capacity;
+    if (budget == CacheBudget::Bytes) return usedBytes > capacity;
+    return false;
+}
+
+///evict (helper) - evict nodes with CLOCK until the tree is back under budget
+/*
+The clock hand moves through the keys in order, wrapping back to the smallest key at the end.
+A node that was read since the hand last passed gets its bit cleared and is skipped, the first
+node without one is removed. keep (the node that was just inserted) is never evicted, so a single
+entry bigger than the budget stays in the tree.
+*/
+void AVLTree::evict(const AVLNode* keep)
+{
+    while (overBudget() && treeSize > (keep ? 1 : 0))
     {
-        // check balance of hook node reusing left and right height variables
-        leftHeight = -1;
-        rightHeight = -1;
-        if (current->left->left) leftHeight = current->left->left->height;
-        if (current->left->right) rightHeight = current->left->right->height;
-        balance = leftHeight - rightHeight;
-        if (balance < 0) //left-right
+        if (clockHand == nullptr)
+        {
+            clockHand = root;
+            while (clockHand->left) clockHand = clockHand->left;
+        }
+        AVLNode* victim = clockHand;
+        clockHand = successor(victim);
+        if (victim == keep) continue;
+        if (victim->tombstone)
         {
-            rotateLeft(current->left);
-            rotateRight(current);
+            // already removed, unlinking it just frees the space
+            tombstones--;
+            removeNode(victim);
+            continue;
         }
-        else //left-left
+        if (victim->referenced)
         {
-            rotateRight(current);
+            victim->referenced = false;
+            continue;
         }
+        removeNode(victim);
+        cacheEvictions++;
     }
-    if (balance <= -2) // hook is to the right
+}
+
+///readAggregate (helper) - a node's subtree sum, min and max without changing anything
+/*
+A stale node is worked out from its children the same way refreshAggregate does, but the result
+isn't stored, so const queries can use this. Only the last operator[] call leaves a stale path,
+so this costs at most one extra walk down that path.
+*/
+AVLTree::Aggregate AVLTree::readAggregate(const AVLNode* node)
+{
+    if (!node->aggregateStale) return *node->subtree;
+    Aggregate result{true, 0, 0, 0};
+    if (!node->tombstone) result = Aggregate{false, node->value, node->value, node->value};
+    for (const AVLNode* child : {node->left, node->right})
     {
-        leftHeight = -1;
-        rightHeight = -1;
-        if (current->right->left) leftHeight = current->right->left->height;
-        if (current->right->right) rightHeight = current->right->right->height;
-        balance = leftHeight - rightHeight;
+        if (child) result = combine(result, readAggregate(child));
+    }
+    return result;
+}
 
-        if (balance > 0) //right-left
-        {
-            rotateRight(current->right);
-            rotateLeft(current);
-        }
-        else //right-right
-        {
-            rotateLeft(current);
-        }
+///refreshAggregate (helper) - recompute a node's subtree sum, min and max from its children
+/*
+Any child that is flagged stale is refreshed first, so this only does work along the paths that
+changed since they were last used
+*/
+void AVLTree::refreshAggregate(AVLNode* node)
+{
+    Aggregate& subtree = *node->subtree;
+    subtree = Aggregate{true, 0, 0, 0};
+    if (!node->tombstone) subtree = Aggregate{false, node->value, node->value, node->value};
+    for (AVLNode* child : {node->left, node->right})
+    {
+        if (child == nullptr) continue;
+        if (child->aggregateStale) refreshAggregate(child);
+        subtree = combine(subtree, *child->subtree);
     }
+    node->aggregateStale = false;
 }
 
-///rotateRight (helper) - do a right rotation on nodes
+///refreshPath (helper) - recompute the aggregates from a changed node up to the root
 /*
-This is a helper function for balance that exectutes a right rotation of the nodes
+Every aggregate that can include the node is on this path, so after it nothing is stale
+(refreshAggregate also picks up any stale children it meets along the way)
 */
-void AVLTree::rotateRight(AVLNode*& current)
+void AVLTree::refreshPath(AVLNode* node)
 {
-    //move nodes
-    AVLNode* hold = current->left->right;
-    current->left->right = current;
-    current = current->left;
-    current->right->left = hold;
+    for (; node; node = node->parent) refreshAggregate(node);
+}
 
-    //update heights
-    current->right->height = current->right->nodeHeight();
-    current->height = current->nodeHeight();
+///refreshStale (helper) - recompute the path the last operator[] call flagged
+/*
+A stale node always has stale ancestors, so if the root isn't flagged there is nothing to do
+*/
+void AVLTree::refreshStale()
+{
+    if (aggregates && root && root->aggregateStale) refreshAggregate(root);
 }
 
-///rotateLeft (helper) - do a left rotation on nodes
+///markStale (helper) - flag a node and its ancestors as needing their aggregates recomputed
 /*
-This is a helper function for balance that exectutes a left rotation of the nodes
+A stale node always has stale ancestors, so the walk can stop at the first one that is already flagged
 */
-void AVLTree::rotateLeft(AVLNode*& current)
+void AVLTree::markStale(AVLNode* node)
 {
-    //move nodes
-    AVLNode* hold = current->right->left;
-    current->right->left = current;
-    current = current->right;
-    current->left->right = hold;
+    while (node && !node->aggregateStale)
+    {
+        node->aggregateStale = true;
+        node = node->parent;
+    }
+}
 
-    //update heights
-    current->left->height = current->left->nodeHeight();
-    current->height = current->nodeHeight();
+///markRemoved (helper) - mark a node as removed without unlinking it
+/*
+The node keeps its place so searches can still pass through it, but it no longer counts toward the
+size or any query results
+*/
+void AVLTree::markRemoved(AVLNode* node)
+{
+    node->tombstone = true;
+    tombstones++;
+    if (aggregates) refreshPath(node);
+    // only the count changes, so unlike a recount this doesn't have to look at any siblings
+    for (; node; node = node->parent) node->tombstonesBelow++;
+}
+
+///firstTombstone (helper) - find the tombstone with the smallest key
+/*
+Each node knows how many tombstones its subtree holds, so this is a single descent that takes the
+left side whenever it has any, however many live nodes sit between the tombstones
+
+returns the leftmost tombstone, the tree must have at least one
+*/
+AVLTree::AVLNode* AVLTree::firstTombstone() const
+{
+    AVLNode* current = root;
+    while (true)
+    {
+        if (current->left && current->left->tombstonesBelow > 0) current = current->left;
+        else if (current->tombstone) return current;
+        else current = current->right;
+    }
+}
+
+///recountTombstones (helper) - recount the tombstones in a node's subtree from its children
+void AVLTree::recountTombstones(AVLNode* node)
+{
+    node->tombstonesBelow = node->tombstone ? 1 : 0;
+    if (node->left) node->tombstonesBelow += node->left->tombstonesBelow;
+    if (node->right) node->tombstonesBelow += node->right->tombstonesBelow;
+}
+
+///recountTombstonePath (helper) - recount from a changed node up to the root
+/*
+This is kept up the same way as the aggregates, every count that can include the node is on this path
+*/
+void AVLTree::recountTombstonePath(AVLNode* node)
+{
+    for (; node; node = node->parent) recountTombstones(node);
+}
+
+///overTombstoneThreshold (helper) - whether lazy removes have left too many tombstones
+bool AVLTree::overTombstoneThreshold() const
+{
+    return lazyRemove && tombstones > compactThreshold * treeSize;
+}
+
+///continueCompaction (helper) - run the compaction pass that the tombstone threshold starts
+/*
+Crossing the threshold starts a pass, and from then on each call unlinks up to compactionStep
+tombstones. The pass runs down to half the threshold before it stops, so the removes after it can
+go back to only marking nodes for a while instead of every remove near the threshold doing a step.
+*/
+void AVLTree::continueCompaction()
+{
+    if (overTombstoneThreshold()) compacting = true;
+    if (!compacting) return;
+    compact(compactionStep);
+    if (tombstones <= compactThreshold * treeSize / 2) compacting = false;
+}
+
+///discardNode (helper) - free a node that has already been taken out of the tree
+/*
+If the clock hand is sitting on the node it starts over, and the node's bytes come off the budget
+*/
+void AVLTree::discardNode(AVLNode* node)
+{
+    if (node == clockHand) clockHand = nullptr;
+    usedBytes -= nodeBytes(node);
+    delete node;
 }
@@ -5,9 +5,12 @@
 #ifndef AVLTREE_H
 #define AVLTREE_H
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <optional>
+#include <span>
+#include <utility>
 
 using namespace std;
 
@@ -17,6 +20,14 @@ public:
     using ValueType = size_t;
 
 protected:
+    // combined values of a group of nodes, empty when there are none to combine
+    struct Aggregate {
+        bool empty;
+        ValueType sum;
+        ValueType min;
+        ValueType max;
+    };
+
     class AVLNode {
     public:
         KeyType key;
@@ -25,8 +36,24 @@ protected:
 
         AVLNode* left;
         AVLNode* right;
+        AVLNode* parent;
+        // sum, min and max of every value in this subtree, null until aggregates are enabled so a tree
+        // without them only pays for the pointer
+        Aggregate* subtree;
+        // CLOCK reference bit, set by reads in bounded mode (mutable so const lookups can set it)
+        mutable bool referenced;
+        // a value below may have been written through operator[] since subtree was computed
+        bool aggregateStale;
+        // removed lazily, the node stays in place for searching but its key is no longer in the tree
+        bool tombstone;
+        // tombstones in this subtree, this node included, so compaction can go straight to them
+        // (32 bits fits in the padding after the flags, so it doesn't make the node any bigger)
+        uint32_t tombstonesBelow;
 
         AVLNode(KeyType key, ValueType value);
+        ~AVLNode();
+        AVLNode(const AVLNode& other) = delete;
+        AVLNode& operator=(const AVLNode& other) = delete;
 
         // 0, 1 or 2
         size_t numChildren() const;
@@ -39,16 +66,68 @@ protected:
     };
 
 public:
+    // read only position in the tree, handed back by find/insert to be used as a hint
+    // a cursor stays valid across inserts into an unbounded tree, but a remove, a batch or any insert
+    // into a bounded tree (which can evict the node) may invalidate it, and using it then is undefined
+    // a cursor remembers the tree it came from, and hinted calls on any other tree (a copy included)
+    // ignore it and search from the root
+    class Cursor {
+    public:
+        Cursor();
+        bool valid() const;
+        const KeyType& key() const;
+        ValueType value() const;
+
+    private:
+        friend class AVLTree;
+        Cursor(const AVLTree* tree, const AVLNode* node);
+        const AVLTree* tree;
+        const AVLNode* node;
+    };
+
+    // one write in a batch passed to applyBatch
+    enum class MutationType { Insert, Update, Remove };
+    struct Mutation {
+        MutationType type;
+        KeyType key;
+        ValueType value; // ignored for Remove
+    };
+
+    // what a bounded tree's capacity counts, None means the tree grows without limit
+    enum class CacheBudget { None, Entries, Bytes };
+    struct CacheStats {
+        size_t hits;
+        size_t misses;
+        size_t evictions;
+    };
 
     AVLTree();
+    AVLTree(size_t capacity, CacheBudget budget);
     bool insert(const KeyType& key, size_t value);
+    bool insert(Cursor& hint, const KeyType& key, ValueType value);
     bool remove(const KeyType& key);
+    vector<bool> applyBatch(span<const Mutation> batch);
     bool contains(const KeyType& key) const;
     optional<ValueType> get(const KeyType& key) const;
+    Cursor find(const KeyType& key) const;
+    Cursor find(const Cursor& hint, const KeyType& key) const;
     ValueType& operator[](const KeyType& key);
+    bool update(const KeyType& key, ValueType value);
     vector<ValueType> findRange( const KeyType& lowKey, const KeyType& highKey) const;
+    void enableAggregates();
+    ValueType sumRange(const KeyType& lowKey, const KeyType& highKey) const;
+    optional<ValueType> minRange(const KeyType& lowKey, const KeyType& highKey) const;
+    optional<ValueType> maxRange(const KeyType& lowKey, const KeyType& highKey) const;
+    void enableLazyRemove(double compactThreshold);
+    size_t compact(size_t maxRemovals);
+    void compact();
+    size_t tombstoneCount() const;
+    vector<pair<KeyType, ValueType>> findPrefix(const KeyType& prefix) const;
+    size_t countPrefix(const KeyType& prefix) const;
     vector<KeyType> keys() const;
     size_t size() const;
+    size_t byteSize() const;
+    CacheStats cacheStats() const;
     size_t getHeight() const;
     AVLTree(const AVLTree& other);
     void operator=(const AVLTree& other);
@@ -60,29 +139,79 @@ private:
     size_t treeSize;
     AVLNode* root;
 
+    /* Bounded cache mode */
+    CacheBudget budget;
+    size_t capacity;
+    size_t usedBytes; //node and key bytes of every node in the tree
+    AVLNode* clockHand; //next node the eviction sweep looks at
+    mutable size_t cacheHits;
+    mutable size_t cacheMisses;
+    size_t cacheEvictions;
+
+    /* Range aggregates */
+    bool aggregates; //whether subtree aggregates are being kept up to date
+
+    /* Lazy remove */
+    bool lazyRemove; //whether remove leaves a tombstone instead of unlinking the node
+    double compactThreshold; //fraction of nodes that can be tombstones before a compaction pass starts
+    size_t tombstones; //tombstoned nodes still in the tree, treeSize counts them too
+    bool compacting; //a compaction pass is running, each remove does a step of it
+
     /* Helper methods for recursion */
 
-    bool insert(const KeyType& key, size_t value, AVLNode*& pointer); //insert the thing
+    const AVLNode* fingerStart(const AVLNode* hint, const KeyType& key) const; //lowest ancestor of hint that can hold key
+    const AVLNode* hintNode(const Cursor& hint) const; //the hint's node, or nullptr if it is invalid or from another tree
     AVLNode* getNode(const KeyType& key, AVLNode* pointer); //gets the node in the key or returns nullptr
     const AVLNode* readNode(const KeyType& key, const AVLNode* pointer) const;
-    bool remove(const KeyType& key, AVLNode*& current); //return thing to delete
     bool contains(const KeyType& key, AVLNode*& current); //return thing to check
     std::optional<ValueType> get(const KeyType& key, AVLNode*& current);
     ValueType& opget(const KeyType& key, AVLNode*& current);
     void findRange( const std::string& lowKey, const std::string& highKey, const AVLNode* current, vector<ValueType>& valueVec) const;
+    void findPrefix(const KeyType& prefix, const AVLNode* current, size_t lowCommon, size_t highCommon,
+                    vector<pair<KeyType, ValueType>>* entries, size_t& count) const;
+    Aggregate aggregateRange(const KeyType& lowKey, const KeyType& highKey, const AVLNode* current,
+                             bool lowBounded, bool highBounded) const;
+    static Aggregate combine(const Aggregate& first, const Aggregate& second);
+    static Aggregate readAggregate(const AVLNode* node); //stored aggregate, or worked out without storing if stale
+    static void refreshAggregate(AVLNode* node); //recompute from the children, fixing stale ones first
+    static void refreshPath(AVLNode* node); //recompute node and every ancestor after a change at node
+    void refreshStale(); //recompute whatever the last operator[] left stale
+    void markStale(AVLNode* node); //flag node and its ancestors after a write through operator[]
+    static size_t commonPrefix(const KeyType& key, const KeyType& prefix, size_t from); //shared length past from
     void keys(AVLNode* current, vector<KeyType>& keyVec) const;
-    AVLNode* copyNode(const AVLNode* current, AVLNode*& clone);
+    AVLNode* copyNode(const AVLNode* current, AVLNode*& clone, AVLNode* parent);
     void clearNode(AVLNode*& current);
     /* Helper methods for remove */
-    // this overloaded remove will do the recursion to remove the node
-    // bool remove(AVLNode*& current, KeyType key);
     // removeNode contains the logic for actually removing a node based on the number of children
-    bool removeNode(AVLNode*& current);
-    // You will implement this, but it is needed for removeNode()
-    void balanceNode(AVLNode* node); //this is where node height assignments should be done
-    void balance(const KeyType& key, AVLNode*& node);
+    AVLNode* removeNode(AVLNode* node); //returns a surviving node close to the removed one
+    void markRemoved(AVLNode* node); //tombstone a node instead of unlinking it
+    AVLNode* firstTombstone() const; //leftmost tombstone, only call this when there is one
+    static void recountTombstones(AVLNode* node); //recount a node's tombstonesBelow from its children
+    static void recountTombstonePath(AVLNode* node); //recount node and every ancestor after a change at node
+    bool overTombstoneThreshold() const;
+    void continueCompaction(); //start a compaction pass if needed and do one bounded step of it
+    void discardNode(AVLNode* node); //free a node that is no longer linked into the tree
+    /* Helper methods for applyBatch */
+    AVLNode* mergeBatch(AVLNode* current, span<const Mutation> batch, const vector<size_t>& order,
+                        size_t low, size_t high, vector<bool>& results, bool& reshaped); //returns the new root
+    bool applyMutation(const Mutation& mutation, AVLNode*& node); //node is null when the key is absent
+    AVLNode* join(AVLNode* left, AVLNode* middle, AVLNode* right); //left < middle < right, any heights
+    AVLNode* join(AVLNode* left, AVLNode* right); //the same without a middle node
+    AVLNode* detachLast(AVLNode* current, AVLNode*& last); //unlink the largest node, returns the new root
+    void collectNodes(AVLNode* current, vector<AVLNode*>& nodes);
+    AVLNode* buildBalanced(const vector<AVLNode*>& nodes, size_t low, size_t high, AVLNode* parent);
+    void rebalanceUpward(AVLNode* node); //fix heights and rotate from node toward the root
+    AVLNode* rebalance(AVLNode* node); //fix one node's height and rotate it, returns the subtree's new root
+    static long long heightOf(const AVLNode* node); //-1 for an empty subtree
+    AVLNode*& link(AVLNode* node); //the pointer (root or a parent's child) that holds node
     void rotateLeft(AVLNode*& node);
     void rotateRight(AVLNode*& node);
+    static AVLNode* successor(AVLNode* node); //next node in key order, or nullptr at the end
+    AVLNode* createNode(const KeyType& key, ValueType value) const; //new node, with an aggregate if they are on
+    static size_t nodeBytes(const AVLNode* node);
+    /* Helper methods for bounded cache mode */
+    bool overBudget() const;
+    void evict(const AVLNode* keep); //remove nodes until back under budget, never keep
 
 };
 
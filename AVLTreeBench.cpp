@@ -0,0 +1,272 @@
+/*
+Benchmarks for the AVL Tree
+Each section times one feature against the plain calls it is meant to replace
+ */
+#include "AVLTree.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+using namespace std;
+
+// zero padded so the string order matches the numeric order
+static string makeKey(size_t i) {
+    char buffer[16];
+    snprintf(buffer, sizeof(buffer), "%010zu", i);
+    return buffer;
+}
+
+// sorted keys where a fraction of them have been swapped with a random position
+static vector<string> disorderedKeys(size_t count, double disorder, mt19937& rng) {
+    vector<string> keys;
+    keys.reserve(count);
+    for (size_t i = 0; i < count; i++) keys.push_back(makeKey(i));
+    size_t swaps = static_cast<size_t>(count * disorder / 2);
+    for (size_t i = 0; i < swaps; i++) {
+        swap(keys[rng() % count], keys[rng() % count]);
+    }
+    return keys;
+}
+
+template <typename Function>
+static double timeMs(Function function) {
+    auto start = chrono::steady_clock::now();
+    function();
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+static void benchHintedInsert() {
+    const size_t count = 200000;
+    mt19937 rng(26);
+    cout << "hinted insert / find, " << count << " keys" << endl;
+    cout << "disorder   insert ms   hinted ms   find ms   hinted find ms" << endl;
+    for (double disorder : {0.0, 0.001, 0.01, 0.1, 0.5, 1.0}) {
+        vector<string> keys = disorderedKeys(count, disorder, rng);
+
+        AVLTree plain;
+        double plainMs = timeMs([&] {
+            for (const string& key : keys) plain.insert(key, 1);
+        });
+
+        AVLTree hinted;
+        double hintedMs = timeMs([&] {
+            AVLTree::Cursor hint;
+            for (const string& key : keys) hinted.insert(hint, key, 1);
+        });
+
+        size_t found = 0;
+        double findMs = timeMs([&] {
+            for (const string& key : keys) found += plain.find(key).valid();
+        });
+        double hintedFindMs = timeMs([&] {
+            AVLTree::Cursor hint;
+            for (const string& key : keys) {
+                AVLTree::Cursor next = hinted.find(hint, key);
+                found += next.valid();
+                hint = next;
+            }
+        });
+
+        printf("%8.3f %11.2f %11.2f %9.2f %16.2f\n", disorder, plainMs, hintedMs, findMs, hintedFindMs);
+        if (found != 2 * count) cout << "lookup mismatch" << endl;
+    }
+    cout << endl;
+}
+
+static void benchPrefix() {
+    const size_t tenants = 100;
+    const size_t buckets = 100;
+    const size_t objects = 50;
+    AVLTree tree;
+    AVLTree::Cursor hint;
+    for (size_t t = 0; t < tenants; t++) {
+        for (size_t b = 0; b < buckets; b++) {
+            for (size_t o = 0; o < objects; o++) {
+                tree.insert(hint, "tenant" + makeKey(t) + "/bucket" + makeKey(b) + "/object" + makeKey(o), o);
+            }
+        }
+    }
+    cout << "prefix scan, " << tree.size() << " keys" << endl;
+    // findPrefix trails findRange as matches grow because of the key copies,
+    // countPrefix copies nothing and is the like for like comparison for the walk itself
+    cout << "(findRange returns values only, findPrefix also copies the keys)" << endl;
+    cout << "prefix                   matches   findRange ms   findPrefix ms   countPrefix ms" << endl;
+    const size_t rounds = 200;
+    for (const string& prefix : {"tenant" + makeKey(42) + "/bucket" + makeKey(7) + "/",
+                                 "tenant" + makeKey(42) + "/", string("tenant"), string("nobody/")}) {
+        size_t matches = tree.countPrefix(prefix);
+        if (matches > 10000) {
+            printf("%-24.24s %8zu   skipped, too many matches for %zu rounds\n", prefix.c_str(), matches, rounds);
+            continue;
+        }
+        double rangeMs = timeMs([&] {
+            for (size_t i = 0; i < rounds; i++) {
+                // the old way: make up an upper bound that sorts after every key with the prefix
+                matches = tree.findRange(prefix, prefix + "\xff").size();
+            }
+        });
+        double prefixMs = timeMs([&] {
+            for (size_t i = 0; i < rounds; i++) matches = tree.findPrefix(prefix).size();
+        });
+        double countMs = timeMs([&] {
+            for (size_t i = 0; i < rounds; i++) matches = tree.countPrefix(prefix);
+        });
+        printf("%-24.24s %8zu %14.2f %15.2f %16.2f\n", prefix.c_str(), matches, rangeMs, prefixMs, countMs);
+    }
+    cout << endl;
+}
+
+static void benchBatch() {
+    const size_t base = 200000;
+    mt19937 rng(28);
+    AVLTree start;
+    for (size_t i = 0; i < base; i++) start.insert(makeKey(2 * i), i);
+
+    cout << "applyBatch vs per key calls, tree of " << base << " keys, ms per batch" << endl;
+    cout << "keys         batch   rounds   per key ms   applyBatch ms" << endl;
+    for (const char* layout : {"random", "clustered"})
+    for (size_t count : {10, 100, 1000, 10000, 20000, 25000, 35000, 50000, 100000, 1000000}) {
+        // small batches are repeated so the timings aren't lost in the noise
+        size_t rounds = max<size_t>(1, 20000 / count);
+        // mostly inserts, with some updates and removes, on random keys or on one random stretch of keys
+        bool clustered = string(layout) == "clustered";
+        vector<vector<AVLTree::Mutation>> batches(rounds);
+        for (vector<AVLTree::Mutation>& batch : batches) {
+            batch.reserve(count);
+            size_t start = rng() % (4 * base);
+            for (size_t i = 0; i < count; i++) {
+                size_t roll = rng() % 10;
+                AVLTree::MutationType type = AVLTree::MutationType::Insert;
+                if (roll >= 8) type = AVLTree::MutationType::Remove;
+                else if (roll >= 6) type = AVLTree::MutationType::Update;
+                size_t key = clustered ? start + rng() % (2 * count) : rng() % (4 * base);
+                batch.push_back({type, makeKey(key), i});
+            }
+        }
+
+        AVLTree perKey(start);
+        double perKeyMs = timeMs([&] {
+            for (const vector<AVLTree::Mutation>& batch : batches) {
+                for (const AVLTree::Mutation& mutation : batch) {
+                    if (mutation.type == AVLTree::MutationType::Insert) perKey.insert(mutation.key, mutation.value);
+                    else if (mutation.type == AVLTree::MutationType::Remove) perKey.remove(mutation.key);
+                    else perKey.update(mutation.key, mutation.value);
+                }
+            }
+        });
+
+        AVLTree batched(start);
+        double batchMs = timeMs([&] {
+            for (const vector<AVLTree::Mutation>& batch : batches) batched.applyBatch(batch);
+        });
+
+        printf("%-10s %8zu %8zu %12.3f %15.3f\n", layout, count, rounds, perKeyMs / rounds, batchMs / rounds);
+        if (perKey.size() != batched.size()) cout << "size mismatch" << endl;
+    }
+    cout << endl;
+}
+
+static void benchAggregates() {
+    const size_t count = 1000000;
+    mt19937 rng(30);
+    AVLTree tree;
+    AVLTree::Cursor hint;
+    for (size_t i = 0; i < count; i++) tree.insert(hint, makeKey(i), rng() % 1000);
+    tree.enableAggregates();
+
+    cout << "sumRange vs summing findRange, " << count << " keys" << endl;
+    cout << "   width   queries   findRange us/query   sumRange us/query" << endl;
+    for (size_t width : {10, 1000, 100000, 1000000}) {
+        // fewer queries for wide ranges, summing findRange is O(width) each
+        size_t queries = min<size_t>(1000, 10000000 / width);
+        vector<pair<string, string>> ranges;
+        for (size_t i = 0; i < queries; i++) {
+            size_t low = rng() % (count - width + 1);
+            ranges.emplace_back(makeKey(low), makeKey(low + width - 1));
+        }
+        size_t expected = 0;
+        double rangeMs = timeMs([&] {
+            for (const auto& [low, high] : ranges) {
+                for (size_t value : tree.findRange(low, high)) expected += value;
+            }
+        });
+        size_t total = 0;
+        double sumMs = timeMs([&] {
+            for (const auto& [low, high] : ranges) total += tree.sumRange(low, high);
+        });
+        printf("%8zu %9zu %20.2f %19.2f\n", width, queries, 1000 * rangeMs / queries, 1000 * sumMs / queries);
+        if (total != expected) cout << "sum mismatch" << endl;
+    }
+    cout << endl;
+}
+
+static void benchLazyRemove() {
+    const size_t tenants = 10;
+    const size_t perTenant = 50000;
+    AVLTree start;
+    AVLTree::Cursor hint;
+    for (size_t t = 0; t < tenants; t++) {
+        for (size_t i = 0; i < perTenant; i++) start.insert(hint, "tenant" + makeKey(t) + "/" + makeKey(i), i);
+    }
+
+    // expire two whole tenants
+    vector<string> expired;
+    for (size_t t = 3; t < 5; t++) {
+        for (size_t i = 0; i < perTenant; i++) expired.push_back("tenant" + makeKey(t) + "/" + makeKey(i));
+    }
+
+    cout << "removing " << expired.size() << " of " << start.size() << " keys, then inserting them again" << endl;
+    cout << "order      mode                  remove ms   reinsert ms   compact() ms   tombstones left" << endl;
+    mt19937 rng(31);
+    for (const char* order : {"sorted", "shuffled"}) {
+        if (string(order) == "shuffled") shuffle(expired.begin(), expired.end(), rng);
+
+        AVLTree eager(start);
+        double eagerMs = timeMs([&] {
+            for (const string& key : expired) eager.remove(key);
+        });
+        size_t eagerSize = eager.size();
+        double eagerInsertMs = timeMs([&] {
+            for (const string& key : expired) eager.insert(key, 0);
+        });
+        printf("%-10s %-20s %10.2f %13.2f %14s %17zu\n", order, "eager", eagerMs, eagerInsertMs, "-",
+               eager.tombstoneCount());
+
+        for (double threshold : {1.0, 0.1}) {
+            AVLTree lazy(start);
+            lazy.enableLazyRemove(threshold);
+            double lazyMs = timeMs([&] {
+                for (const string& key : expired) lazy.remove(key);
+            });
+            size_t left = lazy.tombstoneCount();
+            if (lazy.size() != eagerSize) cout << "size mismatch" << endl;
+
+            // the keys come back while their tombstones are still in place
+            AVLTree revived(lazy);
+            double reinsertMs = timeMs([&] {
+                for (const string& key : expired) revived.insert(key, 0);
+            });
+            if (revived.size() != start.size()) cout << "size mismatch" << endl;
+
+            double compactMs = timeMs([&] { lazy.compact(); });
+            char mode[32];
+            snprintf(mode, sizeof(mode), "lazy, threshold %.1f", threshold);
+            printf("%-10s %-20s %10.2f %13.2f %14.2f %17zu\n", order, mode, lazyMs, reinsertMs, compactMs, left);
+        }
+    }
+    cout << endl;
+}
+
+int main() {
+    benchHintedInsert();
+    benchPrefix();
+    benchBatch();
+    benchAggregates();
+    benchLazyRemove();
+    return 0;
+}
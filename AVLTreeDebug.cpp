@@ -100,5 +100,83 @@ int main() {
      cout << endl << endl;
      cout << tree << endl;
 
+     // hinted insert and find
+     AVLTree sortedTree;
+     AVLTree::Cursor hint;
+     for (char c = 'a'; c <= 'j'; c++) {
+         sortedTree.insert(hint, string(1, c), c); // each insert starts from the last one
+     }
+     cout << sortedTree << endl;
+     hint = sortedTree.find(hint, "h");
+     cout << "h: " << hint.value() << endl; // 104
+     cout << "z: " << sortedTree.find(hint, "z").valid() << endl; // 0
+     cout << endl;
+
+     // findPrefix and countPrefix
+     AVLTree pathTree;
+     pathTree.insert("acme/logs/1", 1);
+     pathTree.insert("acme/logs/2", 2);
+     pathTree.insert("acme/photos/1", 3);
+     pathTree.insert("beta/logs/1", 4);
+     for (const auto& [key, value] : pathTree.findPrefix("acme/logs/")) {
+         cout << key << ":" << value << " "; // acme/logs/1:1 acme/logs/2:2
+     }
+     cout << endl;
+     cout << "acme/ " << pathTree.countPrefix("acme/") << endl; // 3
+     cout << endl;
+
+     // applyBatch
+     vector<AVLTree::Mutation> batch = {
+         {AVLTree::MutationType::Remove, "beta/logs/1", 0},
+         {AVLTree::MutationType::Insert, "acme/logs/3", 5},
+         {AVLTree::MutationType::Update, "acme/logs/1", 10},
+         {AVLTree::MutationType::Update, "gamma/logs/1", 6}, // false, not in the tree
+     };
+     for (bool result : pathTree.applyBatch(batch)) {
+         cout << result << " "; // 1 1 1 0
+     }
+     cout << endl;
+     cout << pathTree << endl;
+
+     // bounded cache mode
+     AVLTree cache(3, AVLTree::CacheBudget::Entries);
+     cache.insert("A", 1);
+     cache.insert("B", 2);
+     cache.insert("C", 3);
+     cache.get("A"); // hit, A gets its reference bit
+     cache.get("Q"); // miss
+     cache.insert("D", 4); // over budget, evicts B since A was read
+     cout << cache << endl;
+     AVLTree::CacheStats stats = cache.cacheStats();
+     cout << "hits " << stats.hits << " misses " << stats.misses << " evictions " << stats.evictions << endl; // 1 1 1
+     cout << endl;
+
+     // range aggregates
+     AVLTree counters;
+     counters.enableAggregates();
+     counters.insert("a", 5);
+     counters.insert("b", 1);
+     counters.insert("c", 9);
+     counters.insert("d", 3);
+     counters.update("c", 2);
+     cout << "sum b-d: " << counters.sumRange("b", "d") << endl; // 6
+     cout << "min a-c: " << counters.minRange("a", "c").value() << endl; // 1
+     cout << "max a-d: " << counters.maxRange("a", "d").value() << endl; // 5
+     cout << endl;
+
+     // lazy remove
+     AVLTree lazyTree;
+     lazyTree.enableLazyRemove(0.5);
+     for (char c = 'a'; c <= 'g'; c++) {
+         lazyTree.insert(string(1, c), c);
+     }
+     lazyTree.remove("b");
+     lazyTree.remove("d"); // the node stays in the tree as a tombstone
+     cout << lazyTree << endl;
+     cout << "size " << lazyTree.size() << " tombstones " << lazyTree.tombstoneCount() << endl; // 5 2
+     cout << "d " << lazyTree.contains("d") << endl; // 0
+     lazyTree.compact();
+     cout << lazyTree << endl;
+
     return 0;
 }